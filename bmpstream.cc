@@ -0,0 +1,220 @@
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include <sys/types.h>
+#include "bmpstream.h"
+
+using namespace rr;
+
+static const unsigned int headerSize = 14 + 40;
+// the frame key sits between the header and the pixels, where readers don't look
+static const unsigned int keyOffset = headerSize, dataOffset = keyOffset + 8;
+
+static void put16(uint8_t *p, uint16_t v){
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+static void put32(uint8_t *p, uint32_t v){
+    put16(p, v & 0xffff);
+    put16(p + 2, v >> 16);
+}
+static uint16_t get16(const uint8_t *p){
+    return p[0] | (p[1] << 8);
+}
+static uint32_t get32(const uint8_t *p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+static uint64_t get64(const uint8_t *p){
+    return get32(p) | (uint64_t(get32(p + 4)) << 32);
+}
+
+static uint64_t rowSize(unsigned int width){
+    return (uint64_t(width) * 3 + 3) & ~uint64_t(3);
+}
+
+BMPStream::BMPStream(): f(nullptr), width(0), height(0), rowsDone(0), key(0){}
+BMPStream::~BMPStream(){
+    close();
+}
+
+void BMPStream::close(){
+    if (f != nullptr){
+        fclose(f);
+        f = nullptr;
+    }
+}
+
+int BMPStream::writeHeader(){
+    uint8_t h[dataOffset];
+    uint64_t size = dataOffset + rowSize(width) * height;
+    memset(h, 0, dataOffset);
+    h[0] = 'B';
+    h[1] = 'M';
+    put32(h + 2, size);
+    put32(h + 6, rowsDone);
+    put32(h + 10, dataOffset);
+    put32(h + 14, 40);
+    put32(h + 18, width);
+    put32(h + 22, -int32_t(height));
+    put16(h + 26, 1);
+    put16(h + 28, 24);
+    put32(h + 34, rowSize(width) * height);
+    put32(h + keyOffset, key);
+    put32(h + keyOffset + 4, key >> 32);
+    if (fseeko(f, 0, SEEK_SET) || fwrite(h, dataOffset, 1, f) != 1 || fflush(f) || fsync(fileno(f)))
+        return -1;
+    return 0;
+}
+
+/*
+    Returns the number of rows already written if fname is a stream of the same frame, as
+    told by key, 0 for a new file and -1 on error. Anything else in fname is overwritten.
+*/
+int BMPStream::open(const char *fname, unsigned int width, unsigned int height, uint64_t key){
+    close();
+    if (dataOffset + rowSize(width) * height > 0xffffffffull){
+        fprintf(stderr, "%s: %ux%u is too large for a BMP file\n", fname, width, height);
+        return -1;
+    }
+    this->width = width;
+    this->height = height;
+    this->key = key;
+    rowsDone = 0;
+    f = fopen(fname, "r+b");
+    if (f != nullptr){
+        uint8_t h[dataOffset];
+        if (fread(h, dataOffset, 1, f) == 1 && h[0] == 'B' && h[1] == 'M' && get32(h + 10) == dataOffset &&
+            get32(h + 18) == width && get32(h + 22) == uint32_t(-int32_t(height)) && h[28] == 24 && get64(h + keyOffset) == key){
+            rowsDone = get32(h + 6);
+            if (rowsDone <= height)
+                return rowsDone;
+            rowsDone = 0;
+        }
+        fclose(f);
+    }
+    f = fopen(fname, "w+b");
+    if (f == nullptr || writeHeader() < 0){
+        perror(fname);
+        close();
+        return -1;
+    }
+    return 0;
+}
+
+int BMPStream::writeRows(const Screen *s, unsigned int rows){
+    std::vector<uint8_t> line(rowSize(width), 0);
+    if (fseeko(f, dataOffset + rowSize(width) * rowsDone, SEEK_SET))
+        return -1;
+    for (unsigned int y = 0; y < rows; y++){
+        for (unsigned int x = 0; x < width; x++){
+            const color &c = s->pixels[y * s->width + x];
+            line[x * 3] = c.b;
+            line[x * 3 + 1] = c.g;
+            line[x * 3 + 2] = c.r;
+        }
+        if (fwrite(&line[0], line.size(), 1, f) != 1)
+            return -1;
+    }
+    // the rows have to be on disk before the header says so
+    if (fflush(f) || fsync(fileno(f)))
+        return -1;
+    rowsDone += rows;
+    return writeHeader();
+}
+
+BMPReader::BMPReader(): f(nullptr), offset(0), bpp(0), bottomUp(0), width(0), height(0){}
+BMPReader::~BMPReader(){
+    close();
+}
+
+void BMPReader::close(){
+    if (f != nullptr){
+        fclose(f);
+        f = nullptr;
+    }
+}
+
+/*
+    Returns 0 if fname is a BMP this reader understands, -1 otherwise.
+*/
+int BMPReader::open(const char *fname){
+    close();
+    f = fopen(fname, "rb");
+    if (f == nullptr){
+        perror(fname);
+        return -1;
+    }
+    uint8_t h[headerSize], masks[12];
+    if (fread(h, headerSize, 1, f) != 1 || h[0] != 'B' || h[1] != 'M' || get32(h + 14) < 40){
+        fprintf(stderr, "%s: not a BMP file\n", fname);
+        close();
+        return -1;
+    }
+    int32_t w = get32(h + 18), hgt = get32(h + 22);
+    uint32_t compression = get32(h + 30);
+    offset = get32(h + 10);
+    bpp = get16(h + 28);
+    // 32-bit files often say BI_BITFIELDS even when the channels are in the usual order
+    int plain = compression == 0 || (compression == 3 && bpp == 32 && fread(masks, 12, 1, f) == 1 &&
+        get32(masks) == 0xff0000 && get32(masks + 4) == 0xff00 && get32(masks + 8) == 0xff);
+    if (!plain || (bpp != 24 && bpp != 32) || w <= 0 || hgt == 0 || hgt == INT32_MIN){
+        fprintf(stderr, "%s: only uncompressed 24 and 32-bit BMP files are supported\n", fname);
+        close();
+        return -1;
+    }
+    width = w;
+    height = hgt < 0 ? -hgt : hgt;
+    bottomUp = hgt > 0;
+    return 0;
+}
+
+/*
+    Fills rgb with rows image rows from top on, counted from the top of the image, as packed
+    RGB. Returns 0 on success and -1 on error.
+*/
+int BMPReader::readRows(unsigned int top, unsigned int rows, uint8_t *rgb){
+    uint64_t stride = (uint64_t(width) * bpp / 8 + 3) & ~uint64_t(3);
+    std::vector<uint8_t> line(stride);
+    for (unsigned int y = top; y < top + rows; y++){
+        unsigned int row = bottomUp ? height - 1 - y : y;
+        if (fseeko(f, offset + stride * row, SEEK_SET) || fread(&line[0], stride, 1, f) != 1)
+            return -1;
+        for (unsigned int x = 0; x < width; x++){
+            const uint8_t *p = &line[size_t(x) * bpp / 8];
+            rgb[0] = p[2];
+            rgb[1] = p[1];
+            rgb[2] = p[0];
+            rgb += 3;
+        }
+    }
+    return 0;
+}
+
+/*
+    Renders the frame bandRows rows at a time straight into a BMP file, resuming an
+    unfinished render of the same frame. Returns 0 on success and -1 on error.
+*/
+int rr::renderToFile(RayRenderer *renderer, const Camera &c, unsigned int height, unsigned int width, unsigned int bandRows, const char *fname){
+    BMPStream out;
+    int top = out.open(fname, width, height, renderer->frameKey(c, width, height, bandRows));
+    if (top < 0)
+        return -1;
+    if (unsigned(top) == height)
+        printf("%s is already rendered.\n", fname);
+    else if (top > 0)
+        printf("Resuming %s at row %d.\n", fname, top);
+    Screen band(bandRows, width);
+    for (unsigned int y = top; y < height; y += bandRows){
+        band.height = y + bandRows < height ? bandRows : height - y;
+        RenderJob job(&band, c);
+        job.frameHeight = height;
+        job.bandTop = y;
+        renderer->runJob(&job);
+        if (out.writeRows(&band, band.height) < 0){
+            perror(fname);
+            return -1;
+        }
+        printf("%u/%u\n", y + band.height, height);
+    }
+    return 0;
+}
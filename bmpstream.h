@@ -0,0 +1,49 @@
+#ifndef __RR_BMPSTREAM_H__
+#define __RR_BMPSTREAM_H__
+
+#include <cstdio>
+#include "core.h"
+
+namespace rr {
+
+/*
+    A 24-bit top-down BMP written a band of rows at a time, so the frame never has to be in
+    memory. The number of rows already on disk is kept in the file header's reserved field,
+    and a key identifying the frame between the header and the pixels, so reopening an
+    unfinished file of the same frame carries on where it stopped.
+*/
+class BMPStream {
+    FILE *f;
+    unsigned int width, height, rowsDone;
+    uint64_t key;
+    int writeHeader();
+    public:
+    BMPStream();
+    ~BMPStream();
+    int open(const char *fname, unsigned int width, unsigned int height, uint64_t key);
+    int writeRows(const Screen *s, unsigned int rows);
+    void close();
+};
+
+/*
+    Reads an uncompressed 24 or 32-bit BMP a few rows at a time, whatever its row order, so
+    images larger than memory can be converted.
+*/
+class BMPReader {
+    FILE *f;
+    uint32_t offset, bpp;
+    int bottomUp;
+    public:
+    unsigned int width, height;
+    BMPReader();
+    ~BMPReader();
+    int open(const char *fname);
+    int readRows(unsigned int top, unsigned int rows, uint8_t *rgb);
+    void close();
+};
+
+int renderToFile(RayRenderer *renderer, const Camera &c, unsigned int height, unsigned int width, unsigned int bandRows, const char *fname);
+
+};
+
+#endif
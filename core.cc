@@ -1,11 +1,16 @@
 #include <new>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include "core.h"
+#include "geomap.h"
 
 using namespace rr;
 Screen::Screen(unsigned h, unsigned w): height(h), width(w){
-    pixels = reinterpret_cast<color *>(malloc(sizeof(color) * h * w));
+    pixels = reinterpret_cast<color *>(malloc(sizeof(color) * h * size_t(w)));
+    if (pixels == nullptr){
+        throw std::bad_alloc();
+    }
     for (unsigned int i = 0; i < h * w - 1; i++){
         new (&pixels[i]) color();
     }
@@ -26,7 +31,10 @@ Camera::Camera(rrfloat ratio, rrfloat fov, const vec3 &pos, const vec3 &dir, con
 
 Object::Object(): prev(nullptr), next(nullptr) {}
 
-RayRenderer::RayRenderer(Screen *s, Engine *e): objHead(nullptr), screen(s), engine(e), maxSteps(10000), antiAlias(0){}
+RenderJob::RenderJob(Screen *s, const Camera &c, int priority): 
+    renderX(0), renderY(0), mapReady(0), mapGeneration(0), symmetry(0), screen(s), camera(c), frameHeight(s->height), bandTop(0), priority(priority), cancelled(0), geodesicMap(nullptr){}
+
+RayRenderer::RayRenderer(Engine *e): objHead(nullptr), engine(e), job(nullptr), preempt(nullptr), maxSteps(10000), antiAlias(0), useSymmetry(0), wavefrontSize(0){}
 
 void RayRenderer::addObject(Object *obj){
     if (objHead != nullptr){
@@ -36,77 +44,444 @@ void RayRenderer::addObject(Object *obj){
     objHead = obj;
 }
 
-void RayRenderer::calculateOnePixel(unsigned x, unsigned int y, color *out){
-    rrfloat a = rrfloat(x) / screen->width - 0.5, b = .5 - rrfloat(y) / screen->height;
-    calculatePoint(x, y, 0, a, b, out);
+void RayRenderer::hashGeometry(Hasher &h, const Camera &c, unsigned int width, unsigned int height) const {
+    engine->hashParams(h);
+    h.add(c.ratio);
+    h.add(c.pos);
+    h.add(c.axis);
+    h.add(c.up);
+    h.add(c.across);
+    h.add(width);
+    h.add(height);
+    h.add(static_cast<unsigned int>(antiAlias));
+    h.add(maxSteps);
+    for (Object *obj = objHead; obj != nullptr; obj = obj->next){
+        obj->hashGeometry(h);
+    }
+}
+
+uint64_t RayRenderer::geometryKey() const {
+    Hasher h;
+    hashGeometry(h, job->camera, job->screen->width, job->screen->height);
+    return h.value;
+}
+
+/*
+    Identifies the finished image of a frame rendered bandRows rows at a time: everything
+    geometryKey covers, the mirrors used, which change the image slightly, and how each
+    object is shaded.
+*/
+uint64_t RayRenderer::frameKey(const Camera &c, unsigned int width, unsigned int height, unsigned int bandRows) const {
+    Hasher h;
+    hashGeometry(h, c, width, height);
+    unsigned int symmetry = useSymmetry ? detectSymmetry(c) : 0;
+    if (bandRows < height)
+        symmetry &= ~MIRROR_Y;
+    h.add(symmetry);
+    for (Object *obj = objHead; obj != nullptr; obj = obj->next){
+        obj->hashShading(h);
+    }
+    return h.value;
+}
+
+/*
+    Pixel x and width - x sample directions mirrored in the camera's across vector, and
+    likewise for rows and the up vector. Such a mirror holds when the engine and every
+    object are symmetric in the corresponding plane, up to rounding: the planes are only
+    matched within a tolerance, and rays grazing the photon sphere blow the difference up
+    to a few pixels of another colour, so it is opt-in through useSymmetry.
+*/
+int RayRenderer::detectSymmetry(const Camera &c) const {
+    vec3 normals[2] = { c.across, c.up };
+    int flags[2] = { MIRROR_X, MIRROR_Y };
+    int ret = 0;
+    for (int i = 0; i < 2; i++){
+        vec3 point, normal;
+        if (!engine->mirrorPlane(c.pos, normals[i].normalize(), &point, &normal))
+            continue;
+        Object *obj = objHead;
+        while (obj != nullptr && obj->mirrorSymmetric(point, normal)){
+            obj = obj->next;
+        }
+        if (obj == nullptr)
+            ret |= flags[i];
+    }
+    return ret;
+}
+
+const Object *RayRenderer::objectAt(int index) const {
+    Object *obj = objHead;
+    while (obj != nullptr && index--){
+        obj = obj->next;
+    }
+    return obj;
 }
 
-void RayRenderer::calculateOnePixelAntialias(unsigned x, unsigned int y, color *out){
-    rrfloat a = rrfloat(x) / screen->width - 0.5, b = .5 - rrfloat(y) / screen->height;
-    rrfloat da = .25 / screen->width, db = .25 / screen->height;
+// offsets of the anti-aliasing samples from the pixel, in quarter pixels
+static const int sampleOffsets[4][2] = { { -1, -1 }, { -1, 1 }, { 1, 1 }, { 1, -1 } };
+
+void RayRenderer::samplePosition(unsigned int x, unsigned int y, unsigned int index, rrfloat *a, rrfloat *b) const {
+    const Screen *screen = job->screen;
+    *a = rrfloat(x) / screen->width - 0.5;
+    *b = .5 - rrfloat(job->bandTop + y) / job->frameHeight;
+    if (antiAlias){
+        *a += sampleOffsets[index][0] * (.25 / screen->width);
+        *b += sampleOffsets[index][1] * (.25 / job->frameHeight);
+    }
+}
+
+int RayRenderer::calculateOnePixel(unsigned x, unsigned int y, color *out){
+    rrfloat a, b;
+    samplePosition(x, y, 0, &a, &b);
+    return calculatePoint(x, y, 0, a, b, out);
+}
+
+int RayRenderer::calculateOnePixelAntialias(unsigned x, unsigned int y, color *out){
     ColorMixer mixer;
     color c;
-    calculatePoint(x, y, 0, a - da, b - db, &c);
-    mixer.addColor(c);
-    calculatePoint(x, y, 1, a - da, b + db, &c);
-    mixer.addColor(c);
-    calculatePoint(x, y, 2, a + da, b + db, &c);
-    mixer.addColor(c);
-    calculatePoint(x, y, 3, a + da, b - db, &c);
-    mixer.addColor(c);
+    for (unsigned int i = 0; i < 4; i++){
+        rrfloat a, b;
+        samplePosition(x, y, i, &a, &b);
+        if (!calculatePoint(x, y, i, a, b, &c))
+            return 0;
+        mixer.addColor(c);
+    }
     mixer.done(out);
+    return 1;
 }
 
-void RayRenderer::calculatePoint(unsigned x, unsigned int y, unsigned int index, rrfloat a, rrfloat b, color *out){
-    const Camera &c = *this->c;
-    
-    vec3 dir = (c.axis + c.across * a + c.up * b).normalize();
-    HitTestResult hresult;
-    rrfloat distance = 0;
+GeodesicSample *RayRenderer::sampleFor(unsigned int x, unsigned int y, unsigned int index) const {
+    return job->geodesicMap->sampleAt((y * job->screen->width + x) * (antiAlias ? 4 : 1) + index);
+}
 
-    ray *start, *end;
-    engine->allocRay(x, y, index, &start, &end);
+void RayRenderer::fireSample(unsigned int x, unsigned int y, rrfloat a, rrfloat b, ray *start, ray *end) const {
+    const Camera &c = job->camera;
+    vec3 dir = (c.axis + c.across * a + c.up * b).normalize();
     start->info.x = end->info.x = x;
     start->info.y = end->info.y = y;
     engine->fireRay(c.pos, dir, start);
     engine->iterateRay(0, start, end);
+}
+
+/*
+    Returns the index of the nearest object hit between start and end, or -1.
+*/
+int RayRenderer::hitObjects(const ray *start, const ray *end, HitTestResult *best) const {
+    HitTestResult hresult;
+    int found = -1, i = 0;
+    for (Object *obj = objHead; obj != nullptr; obj = obj->next, i++){
+        obj->hitTest(start, end, &hresult);
+        if (hresult.status && (found < 0 || hresult.distance < best->distance)){
+            found = i;
+            *best = hresult;
+        }
+    }
+    return found;
+}
+
+static void recordSample(GeodesicSample *sample, int object, const HitTestResult &hresult){
+    sample->object = object;
+    sample->local[0] = hresult.local.e1;
+    sample->local[1] = hresult.local.e2;
+    sample->local[2] = hresult.local.e3;
+}
+
+/*
+    Returns 0 without touching out if the job was cancelled or pre-empted while tracing.
+*/
+int RayRenderer::calculatePoint(unsigned x, unsigned int y, unsigned int index, rrfloat a, rrfloat b, color *out){
+    GeodesicSample *sample = nullptr;
+    if (job->mapReady){
+        sample = sampleFor(x, y, index);
+        if (job->geodesicMap->replay){
+            const Object *obj = objectAt(sample->object);
+            if (obj != nullptr)
+                obj->shade(vec3(sample->local[0], sample->local[1], sample->local[2]), out);
+            else
+                *out = color();
+            return 1;
+        }
+        sample->object = -1;
+    }
+
+    ray *start, *end;
+    engine->allocRay(x, y, index, &start, &end);
+    fireSample(x, y, a, b, start, end);
     unsigned int times = 0;
     while (times < maxSteps){
-        int found = 0;
-        for (Object *obj = objHead; obj != nullptr; obj = obj->next){
-            obj->hitTest(start, end, &hresult);
-            if (hresult.status && (!found || hresult.distance < distance)){
-                found = 1;
-                *out = hresult.c;
-                distance = hresult.distance;
-            }
+        HitTestResult hresult;
+        int found = hitObjects(start, end, &hresult);
+        if (found >= 0){
+            if (sample != nullptr)
+                recordSample(sample, found, hresult);
+            *out = hresult.c;
+            return 1;
         }
-        if (found)
-            return;
+        if ((times & 0xff) == 0xff && interrupted())
+            return 0;
         engine->iterateRay(times++, end, start);
         ray *r = end;
         end = start;
         start = r;
     }
-    *out = hresult.c;
+    *out = color();
+    return 1;
 }
 
-void RayRenderer::startRender(const Camera &c){
-    renderY = 0;
-    this->c = &c;
-}
-void RayRenderer::resetRender(){
-    renderY = 0;
+/*
+    Renders the job from where it last stopped. Returns 1 when the frame is finished,
+    0 if it was cancelled or pre-empted, in which case it can be run again to resume.
+*/
+int RayRenderer::runJob(RenderJob *job, const std::atomic<int> *preempt){
+    Screen *screen = job->screen;
+    this->job = job;
+    this->preempt = preempt;
+    if (job->renderX == 0 && job->renderY == 0){
+        int wholeFrame = job->bandTop == 0 && job->frameHeight == screen->height;
+        // parameters may have changed since the last frame, so the map is looked up per frame
+        unsigned int count = screen->width * screen->height * (antiAlias ? 4 : 1);
+        job->mapReady = wholeFrame && job->geodesicMap != nullptr && job->geodesicMap->load(geometryKey(), count) >= 0;
+        if (job->mapReady)
+            job->mapGeneration = job->geodesicMap->generation;
+        // mirrored pixels are never traced, so they would be missing from the map
+        job->symmetry = useSymmetry && !job->mapReady ? detectSymmetry(job->camera) : 0;
+        // rows of a band mirror rows of other bands
+        if (!wholeFrame)
+            job->symmetry &= ~MIRROR_Y;
+    }
+    else if (job->mapReady && job->geodesicMap->generation != job->mapGeneration){
+        // a job that ran in between loaded the map for its own frame, so whatever this job
+        // replayed or recorded so far no longer belongs to it; trace the rest without the map
+        job->mapReady = 0;
+    }
+    // replaying a map traces nothing, so there is no divergence to hide
+    if (wavefrontSize > 0 && !(job->mapReady && job->geodesicMap->replay))
+        return runWavefront(job);
+    while (job->renderY < screen->height){
+        unsigned int &x = job->renderX, &y = job->renderY;
+        if ((job->symmetry & MIRROR_Y) && 2 * y > screen->height){
+            memcpy(screen->pixelAt(0, y), screen->pixelAt(0, screen->height - y), sizeof(color) * screen->width);
+            x = screen->width;
+        }
+        for (; x < screen->width; x++){
+            if ((job->symmetry & MIRROR_X) && 2 * x > screen->width){
+                *screen->pixelAt(x, y) = *screen->pixelAt(screen->width - x, y);
+                continue;
+            }
+            int done = antiAlias ? 
+                calculateOnePixelAntialias(x, y, screen->pixelAt(x, y)) : 
+                calculateOnePixel(x, y, screen->pixelAt(x, y));
+            if (!done)
+                return 0;
+        }
+        x = 0;
+        y++;
+        if (job->onProgress)
+            job->onProgress(job);
+        if (interrupted())
+            return 0;
+    }
+    if (job->mapReady){
+        job->geodesicMap->finish();
+    }
+    return 1;
 }
-int RayRenderer::stepRender(unsigned int rows){
-    while (renderY < screen->height && rows--){
-        for (unsigned int x = 0; x < screen->width; x++){
-            if (!antiAlias)
-                calculateOnePixel(x, renderY, screen->pixelAt(x, renderY));
+
+struct WaveRay {
+    ray *start, *end;
+    unsigned int x, y, index, times;
+    GeodesicSample *sample;
+};
+
+/*
+    Same result as runJob, but instead of following one ray to the end, keeps up to
+    wavefrontSize rays in flight: each round hit-tests all of them, drops the finished
+    ones, refills the freed slots from the pixels still to do and advances the rest by
+    one step together. Rows are committed in order as their last sample finishes, so an
+    interrupted job resumes from the first unfinished row.
+*/
+int RayRenderer::runWavefront(RenderJob *job){
+    Screen *screen = job->screen;
+    unsigned int width = screen->width, height = screen->height;
+    unsigned int spp = antiAlias ? 4 : 1;
+    // rows that may be in flight at once, so one slow pixel doesn't stall refilling
+    unsigned int rows = 4 * wavefrontSize / (width * spp) + 2;
+    std::vector<unsigned int> rowLeft(rows, 0);
+    std::vector<ColorMixer> mixers(antiAlias ? rows * width : 0);
+
+    std::vector<ray *> rays(2 * wavefrontSize), freeRays;
+    // hands the rays back to the engine however this returns, a bad_alloc below included
+    struct RayBlock {
+        Engine *engine;
+        ray *rays;
+        ~RayBlock(){ engine->freeRays(rays); }
+    } block = { engine, engine->allocRays(2 * wavefrontSize, &rays[0]) };
+    for (unsigned int i = 2 * wavefrontSize; i-- > 0;){
+        freeRays.push_back(rays[i]);
+    }
+    std::vector<WaveRay> wave;
+    std::vector<unsigned int> times;
+    std::vector<const ray *> input;
+    std::vector<ray *> output;
+    wave.reserve(wavefrontSize);
+
+    unsigned int fillX = job->renderX, fillY = job->renderY, fillIndex = 0;
+    int ret = 1;
+    while (true){
+        while (!freeRays.empty() && fillY < height && fillY < job->renderY + rows){
+            if (fillX >= width || ((job->symmetry & MIRROR_Y) && 2 * fillY > height)){
+                fillX = 0;
+                fillY++;
+                continue;
+            }
+            if ((job->symmetry & MIRROR_X) && 2 * fillX > width){
+                fillX++;
+                continue;
+            }
+            WaveRay r;
+            r.end = freeRays.back();
+            freeRays.pop_back();
+            r.start = freeRays.back();
+            freeRays.pop_back();
+            r.x = fillX;
+            r.y = fillY;
+            r.index = fillIndex;
+            r.times = 0;
+            r.sample = nullptr;
+            if (job->mapReady){
+                r.sample = sampleFor(r.x, r.y, r.index);
+                r.sample->object = -1;
+            }
+            rrfloat a, b;
+            samplePosition(r.x, r.y, r.index, &a, &b);
+            fireSample(r.x, r.y, a, b, r.start, r.end);
+            wave.push_back(r);
+            rowLeft[fillY % rows]++;
+            if (++fillIndex == spp){
+                fillIndex = 0;
+                fillX++;
+            }
+        }
+
+        unsigned int alive = 0;
+        for (unsigned int i = 0; i < wave.size(); i++){
+            WaveRay &r = wave[i];
+            HitTestResult hresult;
+            int found = hitObjects(r.start, r.end, &hresult);
+            if (found < 0 && r.times + 1 < maxSteps){
+                wave[alive++] = r;
+                continue;
+            }
+            color c = found >= 0 ? hresult.c : color();
+            if (r.sample != nullptr && found >= 0)
+                recordSample(r.sample, found, hresult);
+            if (antiAlias)
+                mixers[(r.y % rows) * width + r.x].addColor(c);
             else
-                calculateOnePixelAntialias(x, renderY, screen->pixelAt(x, renderY));
+                *screen->pixelAt(r.x, r.y) = c;
+            rowLeft[r.y % rows]--;
+            freeRays.push_back(r.start);
+            freeRays.push_back(r.end);
+        }
+        wave.resize(alive);
+
+        unsigned int &y = job->renderY;
+        while (y < fillY && rowLeft[y % rows] == 0){
+            if ((job->symmetry & MIRROR_Y) && 2 * y > height){
+                memcpy(screen->pixelAt(0, y), screen->pixelAt(0, height - y), sizeof(color) * width);
+            }
+            else for (unsigned int x = job->renderX; x < width; x++){
+                if ((job->symmetry & MIRROR_X) && 2 * x > width){
+                    *screen->pixelAt(x, y) = *screen->pixelAt(width - x, y);
+                }
+                else if (antiAlias){
+                    ColorMixer &mixer = mixers[(y % rows) * width + x];
+                    mixer.done(screen->pixelAt(x, y));
+                    mixer = ColorMixer();
+                }
+            }
+            job->renderX = 0;
+            y++;
+            if (job->onProgress)
+                job->onProgress(job);
+        }
+        if (y >= height)
+            break;
+        if (interrupted()){
+            ret = 0;
+            break;
+        }
+
+        times.resize(alive);
+        input.resize(alive);
+        output.resize(alive);
+        for (unsigned int i = 0; i < alive; i++){
+            WaveRay &r = wave[i];
+            times[i] = r.times++;
+            input[i] = r.end;
+            output[i] = r.start;
+            ray *t = r.end;
+            r.end = r.start;
+            r.start = t;
+        }
+        engine->iterateRays(alive, times.data(), input.data(), output.data());
+    }
+    if (ret && job->mapReady){
+        job->geodesicMap->finish();
+    }
+    return ret;
+}
+
+JobQueue::JobQueue(RayRenderer *r): renderer(r), current(nullptr), preempt(0), stopped(0){}
+
+void JobQueue::submit(RenderJob *job){
+    std::lock_guard<std::mutex> l(lock);
+    pending.push_back(job);
+    if (current != nullptr && job->priority > current->priority){
+        preempt = 1;
+    }
+    cond.notify_one();
+}
+
+void JobQueue::stop(){
+    std::lock_guard<std::mutex> l(lock);
+    stopped = 1;
+    if (current != nullptr){
+        current->cancel();
+    }
+    cond.notify_one();
+}
+
+void JobQueue::run(){
+    std::unique_lock<std::mutex> l(lock);
+    while (true){
+        cond.wait(l, [this]{ return stopped || !pending.empty(); });
+        if (stopped)
+            break;
+        // the first of the highest priority, so equal priorities run in submission order
+        std::vector<RenderJob *>::iterator next = pending.begin();
+        for (std::vector<RenderJob *>::iterator it = pending.begin(); it != pending.end(); ++it){
+            if ((*it)->priority > (*next)->priority)
+                next = it;
+        }
+        RenderJob *job = current = *next;
+        pending.erase(next);
+        preempt = 0;
+        l.unlock();
+
+        int done = !job->cancelled && renderer->runJob(job, &preempt);
+
+        l.lock();
+        current = nullptr;
+        if (!done && !job->cancelled){
+            pending.insert(pending.begin(), job);
+            continue;
         }
-        renderY++;
+        l.unlock();
+        if (job->onDone)
+            job->onDone(job);
+        l.lock();
     }
-    return renderY < screen->height;
+    pending.clear();
+    stopped = 0;
 }
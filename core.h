@@ -4,10 +4,17 @@
 #include <cstdlib>
 #include <cstdint>
 #include <cmath>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
 namespace rr {
 
 typedef double rrfloat;
 class RayRenderer;
+class GeodesicMap;
+struct GeodesicSample;
 
 struct color {
     uint8_t r, g, b, a;
@@ -62,6 +69,21 @@ struct vec3 {
     vec3 operator / (rrfloat a) const { return vec3(e1 / a, e2 / a, e3 / a, patchID); }
     vec3 operator - () const { return vec3(-e1, -e2, -e3, patchID); }
 };
+struct Hasher {
+    uint64_t value;
+    Hasher(): value(14695981039346656037ull){}
+    void add(const void *data, size_t len){
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < len; i++){
+            value ^= p[i];
+            value *= 1099511628211ull;
+        }
+    }
+    void add(rrfloat f){ add(&f, sizeof(f)); }
+    void add(unsigned int i){ add(&i, sizeof(i)); }
+    void add(const vec3 &v){ add(v.e1); add(v.e2); add(v.e3); }
+    void add(const color &c){ add(&c, sizeof(c)); }
+};
 struct RayInfo {
     unsigned int x, y;
 };
@@ -92,6 +114,7 @@ struct HitTestResult {
     int status;
     color c;
     rrfloat distance;
+    vec3 local /* object-specific hit coordinates, enough for shade() to recompute c */;
 };
 
 class Object {
@@ -99,36 +122,121 @@ class Object {
     friend class RayRenderer;
     public:
     Object();
+    virtual ~Object(){}
     virtual void hitTest(const ray *start, const ray *end, HitTestResult *result) const = 0;
+    virtual void shade(const vec3 &local, color *out) const = 0;
+    // everything that affects where rays hit, but not how the hit point is coloured
+    virtual void hashGeometry(Hasher &h) const = 0;
+    // everything shade() depends on
+    virtual void hashShading(Hasher &h) const = 0;
+    // whether reflecting in the plane through point with the given normal leaves the object and its colours unchanged
+    virtual int mirrorSymmetric(const vec3 &point, const vec3 &normal) const { return 0; }
 };
 class Engine {
     public:
     virtual void allocRay(unsigned int x, unsigned int y, unsigned int index, ray **r1, ray **r2) = 0;
     virtual int fireRay(const vec3 &pos, const vec3 &dir, ray *out) const = 0;
     virtual int iterateRay(unsigned int times, const ray *input, ray *output) const = 0;
+    // storage for count independent rays, for renderers that keep many rays in flight
+    virtual ray *allocRays(unsigned int count, ray **rays) = 0;
+    virtual void freeRays(ray *block) = 0;
+    virtual void iterateRays(unsigned int count, const unsigned int *times, const ray *const *input, ray *const *output) const {
+        for (unsigned int i = 0; i < count; i++){
+            iterateRay(times[i], input[i], output[i]);
+        }
+    }
+    virtual void hashParams(Hasher &h) const = 0;
+    /*
+        Maps the plane through the camera position pos with the given normal, expressed in the
+        same frame as the directions passed to fireRay, to a world space plane. Returns 1 only
+        if rays reflected in that plane stay reflections of each other as they are iterated.
+    */
+    virtual int mirrorPlane(const vec3 &pos, const vec3 &normal, vec3 *point, vec3 *worldNormal) const { return 0; }
     // virtual int calculateRay(const vec3 &pos, const vec3 &dir, color *out) const = 0;
 };
 
+enum Symmetry {
+    MIRROR_X = 1,
+    MIRROR_Y = 2
+};
+
+class RenderJob {
+    unsigned int renderX, renderY;
+    int mapReady;
+    unsigned int mapGeneration;
+    int symmetry;
+    friend class RayRenderer;
+    public:
+    Screen *screen;
+    Camera camera;
+    // screen holds rows bandTop .. bandTop + screen->height of a frame frameHeight rows high
+    unsigned int frameHeight, bandTop;
+    int priority;
+    std::atomic<int> cancelled;
+    GeodesicMap *geodesicMap;
+    // called from the thread running the job, after every finished row and when it stops
+    std::function<void (RenderJob *job)> onProgress, onDone;
+    RenderJob(Screen *s, const Camera &c, int priority = 0);
+    void cancel(){ cancelled = 1; }
+    void reset(){ renderX = renderY = 0; cancelled = 0; }
+    int isDone() const { return renderY >= screen->height; }
+    rrfloat progress() const {
+        return (rrfloat(renderY) * screen->width + renderX) / (rrfloat(screen->width) * screen->height);
+    }
+};
+
 class RayRenderer {
     Object *objHead;
-    Screen *screen;
     Engine *engine;
-    unsigned int renderY;
-    const Camera *c;
+    RenderJob *job;
+    const std::atomic<int> *preempt;
 
     public:
     unsigned int maxSteps;
     int antiAlias;
-    RayRenderer(Screen *s, Engine *e);
+    int useSymmetry /* copy mirrored pixels instead of tracing them; off by default, as the copies can differ in a few pixels */;
+    unsigned int wavefrontSize /* rays in flight at once, 0 traces pixel by pixel */;
+    RayRenderer(Engine *e);
     void addObject(Object *obj);
     int performHitTests(const vec3 &start, const vec3 &end, color *c);
-    void startRender(const Camera &c);
-    void resetRender();
-    int stepRender(unsigned int rows);
+    int runJob(RenderJob *job, const std::atomic<int> *preempt = nullptr);
+    uint64_t frameKey(const Camera &c, unsigned int width, unsigned int height, unsigned int bandRows) const;
     private:
-    void calculateOnePixel(unsigned x, unsigned int y, color *out);
-    void calculateOnePixelAntialias(unsigned x, unsigned int y, color *out);
-    void calculatePoint(unsigned x, unsigned int y, unsigned int index, rrfloat a, rrfloat b, color *out);
+    void hashGeometry(Hasher &h, const Camera &c, unsigned int width, unsigned int height) const;
+    int interrupted() const {
+        return job->cancelled.load(std::memory_order_relaxed) || (preempt != nullptr && preempt->load(std::memory_order_relaxed));
+    }
+    uint64_t geometryKey() const;
+    int detectSymmetry(const Camera &c) const;
+    const Object *objectAt(int index) const;
+    GeodesicSample *sampleFor(unsigned int x, unsigned int y, unsigned int index) const;
+    void samplePosition(unsigned int x, unsigned int y, unsigned int index, rrfloat *a, rrfloat *b) const;
+    void fireSample(unsigned int x, unsigned int y, rrfloat a, rrfloat b, ray *start, ray *end) const;
+    int hitObjects(const ray *start, const ray *end, HitTestResult *best) const;
+    int runWavefront(RenderJob *job);
+    int calculateOnePixel(unsigned x, unsigned int y, color *out);
+    int calculateOnePixelAntialias(unsigned x, unsigned int y, color *out);
+    int calculatePoint(unsigned x, unsigned int y, unsigned int index, rrfloat a, rrfloat b, color *out);
+};
+
+/*
+    Runs jobs on one renderer, highest priority first. Submitting a job with a higher
+    priority than the running one pre-empts it; the pre-empted job is put back and later
+    resumes from the pixel it stopped at.
+*/
+class JobQueue {
+    RayRenderer *renderer;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<RenderJob *> pending;
+    RenderJob *current;
+    std::atomic<int> preempt;
+    int stopped;
+    public:
+    JobQueue(RayRenderer *r);
+    void submit(RenderJob *job);
+    void stop();
+    void run();
 };
 
 };
@@ -1,29 +1,12 @@
 #include "display.h"
 using namespace rr;
 
-struct threadData {
-    WindowedRenderer *renderer;
-    const std::function<int ()> &onDone;
-    threadData(WindowedRenderer *r, const std::function<int ()> &onDone): renderer(r), onDone(onDone){}
-};
-
 static int calculateThread(void *ptr){
-    threadData *data = reinterpret_cast<threadData *>(ptr);
-    WindowedRenderer *renderer = data->renderer;
-    do {
-        unsigned int i = 0;
-        while (!renderer->quit && renderer->renderer.stepRender(1)){
-            renderer->updateSurface();
-            printf("%u\n", i++);
-        }
-        renderer->updateSurface();
-        printf("%u\n", i++);
-        renderer->renderer.resetRender();
-    } while(!renderer->quit && data->onDone());
+    reinterpret_cast<JobQueue *>(ptr)->run();
     return 0;
 }
 
-WindowedRenderer::WindowedRenderer(const char *title, Screen *s, Engine *engine): s(s), shouldUpdateSurface(0), renderer(s, engine) {
+WindowedRenderer::WindowedRenderer(const char *title, Screen *s, Engine *engine): s(s), shouldUpdateSurface(0), renderer(engine), queue(&renderer), geodesicMap(nullptr) {
     window = SDL_CreateWindow(title, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, s->width, s->height, 0);
     surface = SDL_GetWindowSurface(window);
 }
@@ -49,10 +32,27 @@ void WindowedRenderer::clear(){
 }
 
 void WindowedRenderer::startRender(const Camera &c, const std::function<int ()> &onDone){
-    renderer.startRender(c);
+    RenderJob job(s, c);
+    unsigned int i = 0;
+    job.geodesicMap = geodesicMap;
+    job.onProgress = [this, &i](RenderJob *job){
+        updateSurface();
+        printf("%u\n", i++);
+    };
+    job.onDone = [this, &c, &i, &onDone](RenderJob *job){
+        updateSurface();
+        printf("%u\n", i);
+        i = 0;
+        if (!quit && job->isDone() && onDone()){
+            // onDone may have moved the camera for the next frame
+            job->camera = c;
+            job->reset();
+            queue.submit(job);
+        }
+    };
     quit = 0;
-    threadData tdata(this, onDone);
-    SDL_Thread *t = SDL_CreateThread(calculateThread, "calculate thread", reinterpret_cast<void *>(&tdata));
+    queue.submit(&job);
+    SDL_Thread *t = SDL_CreateThread(calculateThread, "calculate thread", reinterpret_cast<void *>(&queue));
 
     SDL_Event e;
     while (!quit){
@@ -69,6 +69,7 @@ void WindowedRenderer::startRender(const Camera &c, const std::function<int ()>
         SDL_UnlockSurface(surface);
         SDL_Delay(50);
     }
+    queue.stop();
     int s = 0;
     SDL_WaitThread(t, &s);
 }
@@ -15,6 +15,8 @@ class WindowedRenderer {
     public:
     int quit;
     RayRenderer renderer;
+    JobQueue queue;
+    GeodesicMap *geodesicMap;
     WindowedRenderer(const char *title, Screen *s, Engine *engine);
     ~WindowedRenderer();
     void updateSurface();
@@ -25,4 +27,4 @@ class WindowedRenderer {
 
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,86 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "geomap.h"
+
+using namespace rr;
+
+struct MapHeader {
+    char magic[4];
+    uint32_t complete;
+    uint64_t key;
+    uint64_t count;
+};
+
+// the last byte is the format version, bumped when GeodesicSample changes
+static const char mapMagic[4] = { 'R', 'R', 'G', '2' };
+
+GeodesicMap::GeodesicMap(const char *fname): fname(fname), fd(-1), data(nullptr), size(0), samples(nullptr), replay(0), generation(0){}
+GeodesicMap::~GeodesicMap(){
+    close();
+}
+
+void GeodesicMap::close(){
+    if (data != nullptr){
+        munmap(data, size);
+        data = nullptr;
+    }
+    if (fd >= 0){
+        ::close(fd);
+        fd = -1;
+    }
+    samples = nullptr;
+}
+
+/*
+    Maps the file and returns 1 if it holds a complete map for the given key, which is
+    then only read from. Otherwise the file is resized for count samples and returns 0,
+    the caller is expected to fill every sample and call finish(). Returns -1 on error.
+*/
+int GeodesicMap::load(uint64_t key, unsigned int count){
+    close();
+    replay = 0;
+    generation++;
+    fd = open(fname, O_RDWR | O_CREAT, 0644);
+    if (fd < 0){
+        perror(fname);
+        return -1;
+    }
+    size = sizeof(MapHeader) + sizeof(GeodesicSample) * size_t(count);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t(st.st_size) != size && ftruncate(fd, size) < 0)){
+        perror(fname);
+        close();
+        return -1;
+    }
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED){
+        perror(fname);
+        data = nullptr;
+        close();
+        return -1;
+    }
+    MapHeader *h = reinterpret_cast<MapHeader *>(data);
+    samples = reinterpret_cast<GeodesicSample *>(h + 1);
+    if (!memcmp(h->magic, mapMagic, 4) && h->complete && h->key == key && h->count == count){
+        replay = 1;
+        return 1;
+    }
+    memcpy(h->magic, mapMagic, 4);
+    h->complete = 0;
+    h->key = key;
+    h->count = count;
+    return 0;
+}
+
+void GeodesicMap::finish(){
+    if (data != nullptr && !replay){
+        msync(data, size, MS_SYNC);
+        reinterpret_cast<MapHeader *>(data)->complete = 1;
+        msync(data, sizeof(MapHeader), MS_SYNC);
+        replay = 1;
+    }
+}
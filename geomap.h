@@ -0,0 +1,39 @@
+#ifndef __RR_GEOMAP_H__
+#define __RR_GEOMAP_H__
+
+#include <cstddef>
+#include <cstdint>
+#include "core.h"
+
+namespace rr {
+
+/*
+    Per-sample result of tracing: which object was hit and where, in the object's own
+    coordinates. Shading it again only needs Object::shade, so a frame can be re-textured
+    without tracing a single ray.
+*/
+struct GeodesicSample {
+    int32_t object /* index in the renderer's object list, -1 if nothing was hit */;
+    rrfloat local[3] /* full precision, so shading a replay matches a fresh trace exactly */;
+};
+
+class GeodesicMap {
+    const char *fname;
+    int fd;
+    void *data;
+    size_t size;
+    GeodesicSample *samples;
+    void close();
+    public:
+    int replay;
+    unsigned int generation /* bumped by every load(), so users can tell if someone else loaded it */;
+    GeodesicMap(const char *fname);
+    ~GeodesicMap();
+    int load(uint64_t key, unsigned int count);
+    void finish();
+    GeodesicSample *sampleAt(unsigned int i){ return &samples[i]; }
+};
+
+};
+
+#endif
@@ -0,0 +1,373 @@
+#include <SDL.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include "core.h"
+#include "bmpstream.h"
+#include "texture.h"
+#include "scene.h"
+
+#define DEG(a) ((a) * M_PI / 180)
+
+using namespace rr;
+
+/*
+    Render daemon. Textures and scenes stay loaded between requests, so a request only
+    costs its trace time. Requests are lines of the form
+
+        render scene=skymap sky=../assets/skymap.bmp width=800 height=600 r=7 theta=90 phi=0
+               fov=90 rg=0.5 rq=0 out=frame.bmp
+
+    on a Unix socket, each answered by a line "ok ..." or "error <reason>", e.g.
+
+        echo "render scene=disc out=disc.bmp" | socat - UNIX-CONNECT:/tmp/riemann-ray.sock
+
+    Other commands are "status" and "quit". Any number of clients can be connected, but
+    requests are served one at a time. Sending a request again after it was interrupted
+    resumes its out file.
+*/
+
+typedef std::map<std::string, std::string> Params;
+
+struct Scene {
+    ReissnerEngine engine;
+    RayRenderer renderer;
+    std::vector<std::unique_ptr<Object> > objects;
+    Sphere *horizon /* resized to the outer horizon for every request */;
+    Scene(): engine(0.5, 0, 0.01, 1), renderer(&engine), horizon(nullptr){}
+    void addObject(Object *obj){
+        objects.emplace_back(obj);
+        renderer.addObject(obj);
+    }
+};
+
+class RenderServer {
+    std::map<std::string, std::unique_ptr<Texture> > textures;
+    std::map<std::string, std::unique_ptr<Scene> > scenes;
+    const Texture *texture(const std::string &fname, std::string *error);
+    Scene *scene(const Params &p, std::string *error);
+    std::string render(const Params &p);
+    public:
+    std::string handle(const std::string &line, int *quit);
+};
+
+static std::string param(const Params &p, const char *key, const char *def){
+    Params::const_iterator it = p.find(key);
+    return it == p.end() ? def : it->second;
+}
+
+/*
+    Leaves out untouched if key is missing; returns 0 if it is there but not a number.
+*/
+static int number(const Params &p, const char *key, rrfloat *out){
+    Params::const_iterator it = p.find(key);
+    if (it == p.end())
+        return 1;
+    char *end;
+    rrfloat v = strtod(it->second.c_str(), &end);
+    if (end == it->second.c_str() || *end != '\0')
+        return 0;
+    *out = v;
+    return 1;
+}
+
+/*
+    Like number, for a whole number from 0 to max; returns -1 if it is out of that range.
+*/
+static int integer(const Params &p, const char *key, unsigned int max, unsigned int *out){
+    Params::const_iterator it = p.find(key);
+    if (it == p.end())
+        return 1;
+    char *end;
+    errno = 0;
+    long long v = strtoll(it->second.c_str(), &end, 10);
+    if (end == it->second.c_str() || *end != '\0')
+        return 0;
+    if (errno == ERANGE || v < 0 || v > max)
+        return -1;
+    *out = v;
+    return 1;
+}
+
+static int vector(const Params &p, const char *key, vec3 *out){
+    Params::const_iterator it = p.find(key);
+    if (it == p.end())
+        return 1;
+    char extra;
+    return sscanf(it->second.c_str(), "%lf,%lf,%lf%c", &out->e1, &out->e2, &out->e3, &extra) == 3;
+}
+
+const Texture *RenderServer::texture(const std::string &fname, std::string *error){
+    std::unique_ptr<Texture> &tex = textures[fname];
+    if (!tex){
+        size_t n = fname.size();
+        if (n > 6 && fname.compare(n - 6, 6, ".tiles") == 0)
+            tex.reset(new TiledTexture(fname.c_str()));
+        else
+            tex.reset(new SurfaceTexture(fname.c_str()));
+    }
+    if (tex->width == 0){
+        *error = "cannot load texture " + fname;
+        textures.erase(fname);
+        return nullptr;
+    }
+    return tex.get();
+}
+
+Scene *RenderServer::scene(const Params &p, std::string *error){
+    std::string name = param(p, "scene", "skymap"), sky = param(p, "sky", "../assets/skymap.bmp");
+    std::string key = name == "skymap" ? name + ":" + sky : name;
+    std::unique_ptr<Scene> &s = scenes[key];
+    if (s)
+        return s.get();
+
+    Scene *ret = new Scene();
+    if (name == "skymap"){
+        const Texture *tex = texture(sky, error);
+        if (tex != nullptr){
+            ret->horizon = new Sphere(vec3(0, 0, 0), 0.5, color(0, 0, 0));
+            ret->addObject(ret->horizon);
+            ret->addObject(new TexturedSphere(tex, 10, DEG(270), vec3(0, 0, 0)));
+        }
+    }
+    else if (name == "stripes"){
+        ret->horizon = new Sphere(vec3(0, 0, 0), 0.5, color(0, 0, 0));
+        ret->addObject(ret->horizon);
+        ret->addObject(new StrippedSphere(vec3(0, 0, 0), 10, color(50, 50, 50), color(40, 40, 40), 120, 60));
+    }
+    else if (name == "disc"){
+        ret->addObject(new StrippedSphere(vec3(0, 0, 0), 0.5, color(0, 0, 255), color(0, 0, 0), 10, 5));
+        ret->addObject(new Disc(1, 2, color(255, 255, 255), color(0, 255, 0), 20));
+        ret->addObject(new Sphere(vec3(0, 0, 0), 10, color(50, 50, 50)));
+    }
+    else {
+        *error = "unknown scene " + name;
+    }
+    if (ret->objects.empty()){
+        delete ret;
+        scenes.erase(key);
+        return nullptr;
+    }
+    s.reset(ret);
+    return ret;
+}
+
+std::string RenderServer::render(const Params &p){
+    std::string error;
+    std::string out = param(p, "out", "");
+    if (out.empty())
+        return "error missing out";
+    Scene *s = scene(p, &error);
+    if (s == nullptr)
+        return "error " + error;
+
+    unsigned int width = 400, height = 400, band = 64, maxSteps = 200000, aa = 0, wavefront = 0;
+    rrfloat fov = 90, rg = 0.5, rq = 0, dlambda = 0.01;
+    vec3 pos(7, 90, 0), dir(0, 1, 0), up(0, 0, 1);
+    if (!number(p, "fov", &fov) || !number(p, "rg", &rg) || !number(p, "rq", &rq) || !number(p, "dlambda", &dlambda) ||
+        !number(p, "r", &pos.e1) || !number(p, "theta", &pos.e2) || !number(p, "phi", &pos.e3) ||
+        !vector(p, "dir", &dir) || !vector(p, "up", &up))
+        return "error malformed parameter";
+    // the bounds keep a request from asking for more memory than a render server should give it
+    int ints[] = {
+        integer(p, "width", 16384, &width),
+        integer(p, "height", 16384, &height),
+        integer(p, "band", 4096, &band),
+        integer(p, "maxsteps", 100000000, &maxSteps),
+        integer(p, "aa", 1, &aa),
+        integer(p, "wavefront", 1 << 20, &wavefront),
+    };
+    for (int ok: ints){
+        if (ok == 0)
+            return "error malformed parameter";
+    }
+    for (int ok: ints){
+        if (ok < 0)
+            return "error parameter out of range";
+    }
+    if (width < 1 || height < 1 || band < 1 || dlambda <= 0)
+        return "error parameter out of range";
+
+    s->engine.rg = rg;
+    s->engine.setRq(rq);
+    s->engine.dlambda = dlambda;
+    if (s->horizon != nullptr)
+        s->horizon->r = s->engine.getOutterHorizonRadius();
+    s->renderer.maxSteps = maxSteps;
+    s->renderer.antiAlias = aa;
+    s->renderer.wavefrontSize = wavefront;
+    Camera c(rrfloat(width) / height, fov, vec3(pos.e1, DEG(pos.e2), DEG(pos.e3)), dir, up);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    try {
+        if (renderToFile(&s->renderer, c, height, width, band, out.c_str()) < 0)
+            return "error cannot write " + out;
+    }
+    catch (const std::bad_alloc &){
+        return "error out of memory";
+    }
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+    char buf[50];
+    snprintf(buf, 50, "ok %.3f", t.count());
+    return buf;
+}
+
+std::string RenderServer::handle(const std::string &line, int *quit){
+    std::istringstream in(line);
+    std::string cmd, word;
+    in >> cmd;
+    Params p;
+    while (in >> word){
+        size_t eq = word.find('=');
+        if (eq == std::string::npos)
+            return "error expected key=value, got " + word;
+        p[word.substr(0, eq)] = word.substr(eq + 1);
+    }
+    if (cmd == "render")
+        return render(p);
+    if (cmd == "status"){
+        char buf[80];
+        snprintf(buf, 80, "ok scenes=%zu textures=%zu", scenes.size(), textures.size());
+        return buf;
+    }
+    if (cmd == "quit"){
+        *quit = 1;
+        return "ok";
+    }
+    return "error unknown command " + cmd;
+}
+
+static int writeAll(int fd, const std::string &s){
+    size_t done = 0;
+    while (done < s.size()){
+        ssize_t n = write(fd, s.data() + done, s.size() - done);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        done += n > 0 ? n : 0;
+    }
+    return 0;
+}
+
+struct Client {
+    int fd;
+    std::string buf /* received but not yet a whole line */;
+    explicit Client(int fd): fd(fd){}
+};
+
+// requests are a few hundred bytes, so a longer line is a client talking nonsense
+static const size_t maxLine = 4096;
+
+/*
+    Answers every whole line client has sent. Returns -1 once the client should be dropped.
+*/
+static int serve(RenderServer &server, Client *client, int *quit){
+    char chunk[1024];
+    ssize_t n = read(client->fd, chunk, sizeof(chunk));
+    if (n < 0)
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+    if (n == 0)
+        return -1;
+    client->buf.append(chunk, n);
+    size_t eol;
+    while (!*quit && (eol = client->buf.find('\n')) != std::string::npos){
+        std::string line = client->buf.substr(0, eol);
+        client->buf.erase(0, eol + 1);
+        std::string reply = server.handle(line, quit);
+        printf("%s -> %s\n", line.c_str(), reply.c_str());
+        if (writeAll(client->fd, reply + "\n") < 0)
+            return -1;
+    }
+    if (client->buf.size() > maxLine){
+        writeAll(client->fd, "error line too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, const char *args[]){
+    const char *path = argc > 1 ? args[1] : "/tmp/riemann-ray.sock";
+    // a client hanging up mid-reply shouldn't take the server down
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    // only a socket left behind by an earlier run is ours to replace
+    struct stat st;
+    if (lstat(path, &st) == 0){
+        if (!S_ISSOCK(st.st_mode)){
+            fprintf(stderr, "%s exists and is not a socket\n", path);
+            return 1;
+        }
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || listen(fd, 8) < 0){
+        perror(path);
+        return 1;
+    }
+
+    SDL_Init(0);
+    {
+        RenderServer server;
+        std::vector<Client> clients;
+        std::vector<pollfd> fds;
+        int quit = 0;
+        printf("Listening on %s\n", path);
+        while (!quit){
+            fds.assign(1, pollfd());
+            fds[0].fd = fd;
+            fds[0].events = POLLIN;
+            for (const Client &c: clients){
+                pollfd p = { c.fd, POLLIN, 0 };
+                fds.push_back(p);
+            }
+            if (poll(&fds[0], fds.size(), -1) < 0){
+                if (errno == EINTR)
+                    continue;
+                perror("poll");
+                break;
+            }
+            // fds[i + 1] belongs to clients[i], so clients are only dropped once all are served
+            for (size_t i = 0; i < clients.size() && !quit; i++){
+                if (fds[i + 1].revents && serve(server, &clients[i], &quit) < 0){
+                    close(clients[i].fd);
+                    clients[i].fd = -1;
+                }
+            }
+            for (size_t i = clients.size(); i-- > 0;){
+                if (clients[i].fd < 0)
+                    clients.erase(clients.begin() + i);
+            }
+            if (fds[0].revents & POLLIN){
+                int client = accept(fd, nullptr, nullptr);
+                if (client >= 0)
+                    clients.push_back(Client(client));
+                else if (errno != EINTR)
+                    // e.g. out of descriptors, which frees up as clients leave
+                    perror("accept");
+            }
+        }
+        for (const Client &c: clients){
+            close(c.fd);
+        }
+    }
+    close(fd);
+    unlink(path);
+    SDL_Quit();
+    return 0;
+}
@@ -0,0 +1,34 @@
+#include "scene.h"
+
+using namespace rr;
+
+color rr::getColorAt(const SDL_Surface *image, unsigned int x, unsigned int y){
+    color cl;
+    Uint32 *pixel = reinterpret_cast<Uint32 *>( reinterpret_cast<char *>(image->pixels) + image->pitch * y + image->format->BytesPerPixel * x );
+    if (x < image->w && y < image->h){
+        SDL_GetRGB(*pixel, image->format, &cl.r, &cl.g, &cl.b);
+    }
+    return cl;
+}
+
+vec3 rr::sphericalToCartisian(const vec3 &p){
+    return vec3(p.e1 * sin(p.e2) * cos(p.e3), p.e1 * sin(p.e2) * sin(p.e3), p.e1 * cos(p.e2));
+}
+vec3 rr::cartisianToSpherical(const vec3 &p){
+    rrfloat r = sqrt(p.euclidLen2());
+    rrfloat r2 = sqrt(p.e1*p.e1 + p.e2*p.e2);
+    return vec3(r, atan2(r2, p.e3), atan2(p.e2, p.e1) + M_PI);
+}
+
+/*
+    Whether div patches alternating in phi = atan2(y, x) + pi, as drawn by StrippedSphere
+    and Disc, keep their colours when reflected in a vertical plane through their axis.
+*/
+int rr::phiPatchesSymmetric(unsigned int div, const vec3 &normal){
+    if (div % 2)
+        return 0;
+    // the plane runs along azimuth alpha and sends phi to 2 alpha + 2 pi - phi
+    rrfloat alpha = atan2(normal.e2, normal.e1) + M_PI / 2;
+    rrfloat k = (2*alpha + 2*M_PI) * div / (2*M_PI);
+    return fabs(k - round(k)) < symmetryEps && lround(k) % 2 == 1;
+}
@@ -0,0 +1,329 @@
+#ifndef __RR_SCENE_H__
+#define __RR_SCENE_H__
+
+#include <SDL.h>
+#include "core.h"
+#include "texture.h"
+
+namespace rr {
+
+/*
+    ds^2 = -(1 - r_g / r + r_q^2 / r^2)dt^2 + dr^2 / (1 - r_g / r + r_q^2 / r^2) + r^2 (d\theta^2 + \sin^2\theta d\phi^2)
+*/
+
+static const rrfloat symmetryEps = 1e-9;
+
+color getColorAt(const SDL_Surface *image, unsigned int x, unsigned int y);
+vec3 sphericalToCartisian(const vec3 &p);
+vec3 cartisianToSpherical(const vec3 &p);
+int phiPatchesSymmetric(unsigned int div, const vec3 &normal);
+
+class SurfaceTexture: public Texture {
+    SDL_Surface *image;
+    public:
+    SurfaceTexture(const char *fname){
+        image = SDL_LoadBMP(fname);
+        if (image != nullptr){
+            width = image->w;
+            height = image->h;
+            // the image is in memory anyway, so the key can follow every texel
+            Hasher h;
+            for (unsigned int y = 0; y < height; y++){
+                for (unsigned int x = 0; x < width; x++){
+                    color c = getColorAt(x, y);
+                    h.add(c);
+                }
+            }
+            source = h.value;
+        }
+    }
+    ~SurfaceTexture(){
+        SDL_FreeSurface(image);
+    }
+    color getColorAt(unsigned int x, unsigned int y) const {
+        return x < width && y < height ? rr::getColorAt(image, x, y) : color();
+    }
+};
+
+struct VelRay: public ray {
+    vec3 v;
+    rrfloat C;
+};
+
+class ReissnerEngine: public Engine {
+    VelRay v1, v2;
+    public:
+    rrfloat rg, rq2, dlambda, omega;
+    ReissnerEngine(rrfloat rg, rrfloat rq, rrfloat dlambda, rrfloat omega): rg(rg), rq2(rq * rq), dlambda(dlambda), omega(omega) {}
+    void setRq(rrfloat rq){ rq2 = rq*rq; }
+    rrfloat getOutterHorizonRadius(){
+        rrfloat delta = rg*rg - 4*rq2;
+        return delta > 0 ? (rg + sqrt(delta)) / 2 : 0;
+    }
+    void allocRay(unsigned int x, unsigned int y, unsigned int index, ray **r1, ray **r2){
+        *r1 = &v1;
+        *r2 = &v2;
+    }
+    int fireRay(const vec3 &pos, const vec3 &dir, ray *out) const {
+        VelRay *ra = static_cast<VelRay *>(out);
+        rrfloat r = pos.e1, ct = cos(pos.e2), st = sin(pos.e2);
+        rrfloat cp = cos(pos.e3), sp = sin(pos.e3);
+        rrfloat f = sqrt(1 - rg / r + rq2 / (r*r));
+
+        ra->pos = sphericalToCartisian(pos);
+        ra->v = vec3(
+            -dir.e1 * sp - (dir.e3 * ct + dir.e2 * f * st) * cp,
+            dir.e1 * cp - (dir.e3 * ct + dir.e2 * f * st) * sp,
+            dir.e3 * st - dir.e2 * f * ct
+        ) * omega;
+        ra->C = ra->pos.euclidCross(ra->v).euclidLen2();
+        return 0;
+    }
+    int iterateRay(unsigned int times, const ray *in1, ray *out1) const {
+        const VelRay *in = static_cast<const VelRay *>(in1);
+        VelRay *out = static_cast<VelRay *>(out1);
+
+        rrfloat r = sqrt(in->pos.euclidLen2());
+        rrfloat ddr = in->C / (r*r*r*r) * (- 3*rg / 2 + 2*rq2 / r);
+        vec3 dir = in->pos / r;
+
+        out->C = in->C;
+        out->v = in->v + dir * ddr * dlambda;
+        out->pos = in->pos + in->v * dlambda;
+
+        return 0;
+    }
+    ray *allocRays(unsigned int count, ray **rays){
+        VelRay *block = new VelRay[count];
+        for (unsigned int i = 0; i < count; i++){
+            rays[i] = &block[i];
+        }
+        return block;
+    }
+    void freeRays(ray *block){
+        delete[] static_cast<VelRay *>(block);
+    }
+    void iterateRays(unsigned int count, const unsigned int *times, const ray *const *input, ray *const *output) const {
+        for (unsigned int i = 0; i < count; i++){
+            ReissnerEngine::iterateRay(times[i], input[i], output[i]);
+        }
+    }
+    void hashParams(Hasher &h) const {
+        h.add(rg);
+        h.add(rq2);
+        h.add(dlambda);
+        h.add(omega);
+    }
+    int mirrorPlane(const vec3 &pos, const vec3 &normal, vec3 *point, vec3 *worldNormal) const {
+        // fireRay scales e2 by f, which only keeps a reflection if the normal is along or across e2
+        if (fabs(normal.e2) > symmetryEps && fabs(normal.e2) < 1 - symmetryEps)
+            return 0;
+        rrfloat ct = cos(pos.e2), st = sin(pos.e2);
+        rrfloat cp = cos(pos.e3), sp = sin(pos.e3);
+
+        *point = sphericalToCartisian(pos);
+        *worldNormal = vec3(
+            -normal.e1 * sp - (normal.e3 * ct + normal.e2 * st) * cp,
+            normal.e1 * cp - (normal.e3 * ct + normal.e2 * st) * sp,
+            normal.e3 * st - normal.e2 * ct
+        );
+        // the metric is spherically symmetric, so any plane through the centre will do
+        return fabs(worldNormal->euclidDot(*point)) < symmetryEps * pos.e1;
+    }
+};
+
+class TexturedSphere: public Object {
+    const Texture *image;
+    rrfloat r, phase;
+    vec3 centre;
+    public:
+    TexturedSphere(const Texture *image, rrfloat r, rrfloat phase, const vec3 &centre): image(image), r(r), phase(phase), centre(centre){}
+    void hitTest(const ray *start, const ray *end, HitTestResult *result) const {
+        vec3 pos1 = start->pos - centre, pos2 = end->pos - centre;
+        rrfloat r1 = sqrt(pos1.euclidLen2()), r2 = sqrt(pos2.euclidLen2());
+        if ((r1 < r) ^ (r2 < r)){
+            rrfloat r12 = pos1.euclidLen2(), r22 = pos2.euclidLen2(), dot = pos1.euclidDot(pos2);
+            rrfloat a = r12 + r22 - 2*dot, b = 2*(dot - r12), c = r12 - r*r;
+            rrfloat l = (-b - sqrt(b*b - 4*a*c)) / (2*a);
+            vec3 p = cartisianToSpherical(pos1 + (pos2 - pos1) * l);
+
+            result->status = 1;
+            result->distance = r > r1 ? r - r1 : r1 - r;
+            result->local = p;
+            shade(p, &result->c);
+        }
+        else {
+            result->status = 0;
+        }
+    }
+    void shade(const vec3 &local, color *out) const {
+        vec3 p = local;
+        p.e3 += phase;
+        while (p.e3 < 0) p.e3 += 2*M_PI;
+        while (p.e3 > 2*M_PI) p.e3 -= 2*M_PI;
+
+        rrfloat x = p.e3 * image->width / (2*M_PI);
+        rrfloat y = (1 - cos(p.e2)) / 2 * image->height;
+        unsigned int x0 = static_cast<unsigned int>(x), y0 = static_cast<unsigned int>(y);
+
+        colorx c1 = colorx(image->getColorAt(x0, y0));
+        colorx c2 = colorx(image->getColorAt(x0 + 1, y0));
+        colorx c3 = colorx(image->getColorAt(x0, y0 + 1));
+        colorx c4 = colorx(image->getColorAt(x0 + 1, y0 + 1));
+        rrfloat m = x - x0, n = y - y0;
+        *out = (c1 * (1 - m) * (1 - n) + c2 * m * (1 - n) + c3 * (1 - m) * n + c4 * m * n).toColor();
+    }
+    void hashGeometry(Hasher &h) const {
+        h.add(r);
+        h.add(centre);
+    }
+    void hashShading(Hasher &h) const {
+        h.add(phase);
+        image->hash(h);
+    }
+};
+
+class Sphere: public Object {
+    public:
+    vec3 centre;
+    rrfloat r;
+    color c;
+    Sphere(const vec3 &centre, rrfloat r, const color &c): Object(), centre(centre), r(r), c(c){}
+    void hitTest(const ray *start, const ray *end, HitTestResult *result) const {
+        vec3 pos1 = start->pos - centre, pos2 = end->pos - centre;
+        rrfloat r1 = sqrt(pos1.euclidLen2()), r2 = sqrt(pos2.euclidLen2());
+        if (r1 < r && r2 > r){
+            result->status = 1;
+            result->distance = r - r1;
+            result->c = c;
+        }
+        else if (r1 > r && r2 < r){
+            result->status = 1;
+            result->distance = r1 - r;
+            result->c = c;
+        }
+        else {
+            result->status = 0;
+        }
+    }
+    void shade(const vec3 &local, color *out) const {
+        *out = c;
+    }
+    void hashGeometry(Hasher &h) const {
+        h.add(r);
+        h.add(centre);
+    }
+    void hashShading(Hasher &h) const {
+        h.add(c);
+    }
+    int mirrorSymmetric(const vec3 &point, const vec3 &normal) const {
+        return fabs(normal.euclidDot(centre - point)) < symmetryEps;
+    }
+};
+
+class StrippedSphere: public Object {
+    public:
+    rrfloat r;
+    color c1, c2;
+    rrfloat phiPatch, thetalPatch;
+    vec3 centre;
+    StrippedSphere(const vec3 &centre, rrfloat r, const color &c1, const color &c2, unsigned int phidiv, unsigned int thetadiv): 
+        Object(), r(r), c1(c1), c2(c2), phiPatch(2*M_PI / phidiv), thetalPatch(M_PI / thetadiv), centre(centre){}
+    void hitTest(const ray *start, const ray *end, HitTestResult *result) const {
+        vec3 pos1 = start->pos - centre, pos2 = end->pos - centre;
+        rrfloat r1 = sqrt(pos1.euclidLen2()), r2 = sqrt(pos2.euclidLen2());
+        if ((r1 < r) ^ (r2 < r)){
+            rrfloat r12 = pos1.euclidLen2(), r22 = pos2.euclidLen2(), dot = pos1.euclidDot(pos2);
+            rrfloat a = r12 + r22 - 2*dot, b = 2*(dot - r12), c = r12 - r*r;
+            rrfloat l = (-b - sqrt(b*b - 4*a*c)) / (2*a);
+            vec3 p = cartisianToSpherical(pos1 + (pos2 - pos1) * l);
+
+            result->status = 1;
+            result->local = p;
+            shade(p, &result->c);
+            result->distance = r > r1 ? r - r1 : r1 - r;
+        }
+        else {
+            result->status = 0;
+        }
+    }
+    void shade(const vec3 &local, color *out) const {
+        unsigned int i = static_cast<unsigned int>(local.e2 / thetalPatch) % 2;
+        unsigned int j = static_cast<unsigned int>(local.e3 / phiPatch) % 2;
+        *out = (i ^ j) ? c1 : c2;
+    }
+    void hashGeometry(Hasher &h) const {
+        h.add(r);
+        h.add(centre);
+    }
+    void hashShading(Hasher &h) const {
+        h.add(c1);
+        h.add(c2);
+        h.add(phiPatch);
+        h.add(thetalPatch);
+    }
+    int mirrorSymmetric(const vec3 &point, const vec3 &normal) const {
+        if (fabs(normal.euclidDot(centre - point)) > symmetryEps)
+            return 0;
+        if (fabs(normal.e3) > 1 - symmetryEps)
+            // theta goes to pi - theta, which keeps the colours for an odd number of patches
+            return lround(M_PI / thetalPatch) % 2;
+        if (fabs(normal.e3) < symmetryEps)
+            return phiPatchesSymmetric(lround(2*M_PI / phiPatch), normal);
+        return 0;
+    }
+};
+
+class Disc: public Object {
+    public:
+    rrfloat r, R;
+    color c1, c2;
+    rrfloat dphi;
+    Disc(rrfloat r, rrfloat R, const color &c1, const color &c2, unsigned int div): r(r), R(R), c1(c1), c2(c2), dphi(2*M_PI / div){}
+    void hitTest(const ray *start, const ray *end, HitTestResult *result) const {
+        const vec3 &p1 = start->pos, &p2 = end->pos;
+        if ((p1.e3 > 0) ^ (p2.e3 > 0)){
+            rrfloat l = p1.e3 / (p1.e3 - p2.e3);
+            vec3 p = p1 + (p2 - p1) * l;
+            rrfloat r0 = sqrt(p.e1*p.e1 + p.e2*p.e2);
+            if (r0 > r && r0 < R){
+                result->status = 1;
+                result->local = vec3(r0, atan2(p.e2, p.e1) + M_PI, 0);
+                shade(result->local, &result->c);
+                result->distance = sqrt((p1 - p).euclidLen2());
+            }
+            else {
+                result->status = 0;
+            }
+        }
+        else {
+            result->status = 0;
+        }
+    }
+    void shade(const vec3 &local, color *out) const {
+        unsigned int i = static_cast<unsigned int>(local.e2 / dphi) % 2;
+        *out = i ? c1 : c2;
+    }
+    void hashGeometry(Hasher &h) const {
+        h.add(r);
+        h.add(R);
+    }
+    void hashShading(Hasher &h) const {
+        h.add(c1);
+        h.add(c2);
+        h.add(dphi);
+    }
+    int mirrorSymmetric(const vec3 &point, const vec3 &normal) const {
+        if (fabs(normal.euclidDot(point)) > symmetryEps)
+            return 0;
+        if (fabs(normal.e3) > 1 - symmetryEps)
+            return 1;
+        if (fabs(normal.e3) < symmetryEps)
+            return phiPatchesSymmetric(lround(2*M_PI / dphi), normal);
+        return 0;
+    }
+};
+
+};
+
+#endif
\ No newline at end of file
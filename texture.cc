@@ -0,0 +1,169 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "texture.h"
+
+using namespace rr;
+
+struct TileHeader {
+    char magic[4];
+    uint32_t width, height, tileSize;
+    uint32_t page /* the header takes one page and every tile starts on a page boundary */;
+};
+
+// the last byte is the format version
+static const char tileMagic[4] = { 'R', 'R', 'T', '2' };
+
+static size_t tileBytes(unsigned int tileSize){
+    return size_t(tileSize) * tileSize * 3;
+}
+
+/*
+    Distance between tiles in the file, padded to whole pages so each tile can be dropped
+    from memory on its own.
+*/
+static size_t tileStride(unsigned int tileSize, size_t page){
+    return (tileBytes(tileSize) + page - 1) / page * page;
+}
+
+TiledTexture::TiledTexture(const char *fname, unsigned int cacheTiles): fd(-1), data(nullptr), size(0), page(0), stride(0), tileSize(0), tilesX(0), capacity(cacheTiles){
+    fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0){
+        perror(fname);
+        return;
+    }
+    size = st.st_size;
+    void *p = size >= sizeof(TileHeader) ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (p == MAP_FAILED){
+        fprintf(stderr, "%s: cannot map tiled texture\n", fname);
+        return;
+    }
+    data = reinterpret_cast<uint8_t *>(p);
+    const TileHeader *h = reinterpret_cast<const TileHeader *>(data);
+    if (memcmp(h->magic, tileMagic, 4) || h->tileSize == 0 || h->page == 0){
+        fprintf(stderr, "%s: not a tiled texture\n", fname);
+        return;
+    }
+    if (h->page % sysconf(_SC_PAGESIZE)){
+        fprintf(stderr, "%s: tiles are not page aligned on this machine, recreate it with tilesky\n", fname);
+        return;
+    }
+    page = h->page;
+    stride = tileStride(h->tileSize, page);
+    tilesX = (h->width + h->tileSize - 1) / h->tileSize;
+    unsigned int tilesY = (h->height + h->tileSize - 1) / h->tileSize;
+    if (page + stride * tilesX * tilesY > size){
+        fprintf(stderr, "%s: truncated tiled texture\n", fname);
+        return;
+    }
+    // reading every tile to hash it would defeat mapping the file, so regenerating it is
+    // told apart by its header, size and modification time instead
+    Hasher key;
+    key.add(h, sizeof(TileHeader));
+    key.add(&st.st_size, sizeof(st.st_size));
+    key.add(&st.st_mtim, sizeof(st.st_mtim));
+    source = key.value;
+    // lookups treat zero size as not loaded, so the header is only trusted from here on
+    tileSize = h->tileSize;
+    width = h->width;
+    height = h->height;
+    where.resize(tilesX * tilesY);
+    resident.resize(tilesX * tilesY, 0);
+    // sampling the sky jumps around, read-ahead would mostly fetch tiles nobody looks at
+    madvise(data, size, MADV_RANDOM);
+}
+
+TiledTexture::~TiledTexture(){
+    if (data != nullptr){
+        munmap(data, size);
+    }
+    if (fd >= 0){
+        close(fd);
+    }
+}
+
+void TiledTexture::touch(unsigned int tile) const {
+    std::lock_guard<std::mutex> l(lock);
+    if (resident[tile]){
+        lru.splice(lru.begin(), lru, where[tile]);
+        return;
+    }
+    lru.push_front(tile);
+    where[tile] = lru.begin();
+    resident[tile] = 1;
+    if (lru.size() > capacity){
+        unsigned int old = lru.back();
+        lru.pop_back();
+        resident[old] = 0;
+        // the mapping is read only, so a thread still sampling it just faults the tile back in
+        if (madvise(data + page + stride * old, stride, MADV_DONTNEED) < 0)
+            perror("madvise");
+    }
+}
+
+color TiledTexture::getColorAt(unsigned int x, unsigned int y) const {
+    if (x >= width || y >= height)
+        return color();
+    unsigned int tile = (y / tileSize) * tilesX + x / tileSize;
+    touch(tile);
+    const uint8_t *p = data + page + stride * tile + (size_t(y % tileSize) * tileSize + x % tileSize) * 3;
+    return color(p[0], p[1], p[2]);
+}
+
+/*
+    Writes a tiled texture of the given size. The source is read one row of tiles at a time:
+    readRows fills rgb with rows image rows from top on, packed RGB, and returns -1 after
+    reporting an error, so only tileSize rows are ever in memory. Tiles on the right and
+    bottom edges are padded to full size, and every tile to whole pages. Returns 0 on success.
+*/
+int TiledTexture::create(const char *fname, unsigned int width, unsigned int height, unsigned int tileSize, 
+    const std::function<int (unsigned int top, unsigned int rows, uint8_t *rgb)> &readRows){
+    FILE *f = fopen(fname, "wb");
+    if (f == nullptr){
+        perror(fname);
+        return -1;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    std::vector<uint8_t> buf(page > tileStride(tileSize, page) ? page : tileStride(tileSize, page), 0);
+    TileHeader h;
+    memcpy(h.magic, tileMagic, 4);
+    h.width = width;
+    h.height = height;
+    h.tileSize = tileSize;
+    h.page = page;
+    memcpy(&buf[0], &h, sizeof(h));
+    int ok = fwrite(&buf[0], page, 1, f) == 1, source = 1;
+    memset(&buf[0], 0, sizeof(h));
+
+    std::vector<uint8_t> band(size_t(width) * tileSize * 3);
+    unsigned int tilesX = (width + tileSize - 1) / tileSize, tilesY = (height + tileSize - 1) / tileSize;
+    for (unsigned int ty = 0; ok && source && ty < tilesY; ty++){
+        unsigned int top = ty * tileSize, rows = height - top < tileSize ? height - top : tileSize;
+        if (readRows(top, rows, &band[0]) < 0){
+            source = 0;
+            break;
+        }
+        for (unsigned int tx = 0; ok && tx < tilesX; tx++){
+            for (unsigned int y = 0; y < tileSize; y++){
+                for (unsigned int x = 0; x < tileSize; x++){
+                    unsigned int px = tx * tileSize + x;
+                    uint8_t *p = &buf[(size_t(y) * tileSize + x) * 3];
+                    if (px < width && y < rows)
+                        memcpy(p, &band[(size_t(y) * width + px) * 3], 3);
+                    else
+                        memset(p, 0, 3);
+                }
+            }
+            ok = fwrite(&buf[0], tileStride(tileSize, page), 1, f) == 1;
+        }
+    }
+    if (fclose(f) || !ok){
+        perror(fname);
+        return -1;
+    }
+    return source ? 0 : -1;
+}
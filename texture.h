@@ -0,0 +1,55 @@
+#ifndef __RR_TEXTURE_H__
+#define __RR_TEXTURE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <vector>
+#include "core.h"
+
+namespace rr {
+
+class Texture {
+    public:
+    unsigned int width, height;
+    uint64_t source /* hash of the texels, or of what the file says about them when it is too big to read through */;
+    Texture(): width(0), height(0), source(0){}
+    virtual ~Texture(){}
+    // black outside the image
+    virtual color getColorAt(unsigned int x, unsigned int y) const = 0;
+    void hash(Hasher &h) const {
+        h.add(&source, sizeof(source));
+        h.add(width);
+        h.add(height);
+    }
+};
+
+/*
+    A texture stored as square tiles in a file made once by TiledTexture::create (see
+    tilesky.cc). The file is memory mapped, so opening it costs nothing whatever its size;
+    tiles are paged in as they are sampled and only the cacheTiles most recently used ones
+    are kept resident. Safe to sample from several threads.
+*/
+class TiledTexture: public Texture {
+    int fd;
+    uint8_t *data;
+    size_t size, page, stride;
+    unsigned int tileSize, tilesX, capacity;
+    mutable std::mutex lock;
+    mutable std::list<unsigned int> lru;
+    mutable std::vector<std::list<unsigned int>::iterator> where;
+    mutable std::vector<char> resident;
+    void touch(unsigned int tile) const;
+    public:
+    TiledTexture(const char *fname, unsigned int cacheTiles = 256);
+    ~TiledTexture();
+    color getColorAt(unsigned int x, unsigned int y) const;
+    static int create(const char *fname, unsigned int width, unsigned int height, unsigned int tileSize, 
+        const std::function<int (unsigned int top, unsigned int rows, uint8_t *rgb)> &readRows);
+};
+
+};
+
+#endif
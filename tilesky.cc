@@ -0,0 +1,52 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "bmpstream.h"
+#include "texture.h"
+
+using namespace rr;
+
+/*
+    Converts a BMP skymap into the tiled format TiledTexture maps at render time. The BMP is
+    read one row of tiles at a time, so skymaps larger than memory can be converted.
+*/
+int main(int argc, const char *args[]){
+    if (argc < 3){
+        fprintf(stderr, "usage: %s <skymap.bmp> <skymap.tiles> [tile size]\n", args[0]);
+        return 1;
+    }
+    unsigned long tileSize = 256;
+    if (argc > 3){
+        char *end;
+        errno = 0;
+        tileSize = strtoul(args[3], &end, 10);
+        // strtoul takes "-5" as a huge number, so any sign is rejected up front
+        if (args[3][0] < '0' || args[3][0] > '9' || *end != '\0' || errno == ERANGE || tileSize == 0 || tileSize > 65536){
+            fprintf(stderr, "invalid tile size %s, expected 1 to 65536\n", args[3]);
+            return 1;
+        }
+    }
+    BMPReader in;
+    if (in.open(args[1]) < 0)
+        return 1;
+
+    int ret;
+    try {
+        ret = TiledTexture::create(args[2], in.width, in.height, tileSize, [&in, args](unsigned int top, unsigned int rows, uint8_t *rgb) -> int {
+            if (in.readRows(top, rows, rgb) < 0){
+                fprintf(stderr, "%s: truncated BMP file\n", args[1]);
+                return -1;
+            }
+            return 0;
+        });
+    }
+    catch (const std::bad_alloc &){
+        // a row of tiles this large doesn't fit in memory
+        fprintf(stderr, "out of memory for %lu pixel tiles of a %u pixel wide image\n", tileSize, in.width);
+        return 1;
+    }
+    if (ret == 0)
+        printf("%s: %ux%u in %lu pixel tiles.\n", args[2], in.width, in.height, tileSize);
+    return ret ? 1 : 0;
+}